@@ -7,16 +7,352 @@
 #define __FAKEDOS__
 #define far 
 
+#define FAKE_MEM_SIZE (1024L * 1024L)
+#define FAKE_MEM_FILL 0xAA
+#define FAKE_PAGE_SIZE 4096L
+#define FAKE_PAGE_COUNT (FAKE_MEM_SIZE / FAKE_PAGE_SIZE)
+
+// Stand-in EMS driver, so the EMS code paths can run outside of DOS.
+#define FAKE_EMS_DRIVER_SEG 0x0100
+#define FAKE_EMS_FRAME_SEG 0xE000
+#define FAKE_EMS_PAGE_SIZE (16L * 1024L)
+#define FAKE_EMS_PAGE_COUNT 64
+#define FAKE_EMS_HANDLE_COUNT 4
+
 static unsigned char *fakeMem;
 
+static void FakeEmsInstall(void);
+
 static void *MK_FP(unsigned long seg, unsigned long off)
 {
 	if (fakeMem == NULL)
 	{
-		const int size = 1024 * 1024;
-		fakeMem = (unsigned char *)malloc(size);
-		memset(fakeMem, 0xAA, size);
+		fakeMem = (unsigned char *)malloc(FAKE_MEM_SIZE);
+		memset(fakeMem, FAKE_MEM_FILL, FAKE_MEM_SIZE);
+		FakeEmsInstall();
 	}
 
 	return fakeMem + (seg << 4) + off;
-}
\ No newline at end of file
+}
+
+struct WORDREGS
+{
+	unsigned short ax, bx, cx, dx, si, di, cflag, flags;
+};
+
+struct BYTEREGS
+{
+	unsigned char al, ah, bl, bh, cl, ch, dl, dh;
+};
+
+union REGS
+{
+	struct WORDREGS x;
+	struct BYTEREGS h;
+};
+
+struct SREGS
+{
+	unsigned short es, cs, ss, ds;
+};
+
+// INT 13h handlers returned by INT 2Fh AH=13h. Starts as the usual XT
+// BIOS entry point.
+static unsigned short fakeDiskHandlerSeg = 0xF000;
+static unsigned short fakeDiskHandlerOff = 0xEC59;
+static unsigned short fakeDiskBootHandlerSeg = 0xF000;
+static unsigned short fakeDiskBootHandlerOff = 0xEC59;
+
+// EMS with up to 4 handles sharing 64 pages. Only physical page 0 is
+// supported. Mapping a page copies the frame back to the previously
+// mapped page then copies the new page in, like a real EMS board without
+// the speed. Handle numbers are the index into fakeEmsHandles plus one.
+typedef struct _FakeEmsHandle
+{
+	unsigned char *pages;
+	unsigned short numAllocated;
+} FakeEmsHandle;
+
+static FakeEmsHandle fakeEmsHandles[FAKE_EMS_HANDLE_COUNT];
+static unsigned short fakeEmsNumFree = FAKE_EMS_PAGE_COUNT;
+static FakeEmsHandle *fakeEmsMappedHandle;
+static long fakeEmsMappedPage = -1;
+
+static void FakeEmsInstall(void)
+{
+	unsigned short *vector = (unsigned short *)(fakeMem + 0x67 * 4);
+
+	vector[0] = 0;
+	vector[1] = FAKE_EMS_DRIVER_SEG;
+	memcpy(fakeMem + (FAKE_EMS_DRIVER_SEG << 4) + 10, "EMMXXXX0", 8);
+}
+
+static void FakeEmsUnmap(void)
+{
+	if (fakeEmsMappedPage >= 0)
+	{
+		memcpy(fakeEmsMappedHandle->pages + fakeEmsMappedPage * FAKE_EMS_PAGE_SIZE,
+			   fakeMem + (FAKE_EMS_FRAME_SEG << 4),
+			   FAKE_EMS_PAGE_SIZE);
+		fakeEmsMappedHandle = NULL;
+		fakeEmsMappedPage = -1;
+	}
+}
+
+// Returns the handle for dx, or NULL if it isn't allocated.
+static FakeEmsHandle *FakeEmsGetHandle(unsigned short handle)
+{
+	if (handle == 0 || handle > FAKE_EMS_HANDLE_COUNT || !fakeEmsHandles[handle - 1].pages)
+	{
+		return NULL;
+	}
+
+	return &fakeEmsHandles[handle - 1];
+}
+
+static int int86(int intno, union REGS *inregs, union REGS *outregs)
+{
+	union REGS regs = *inregs;
+	FakeEmsHandle *handle;
+	unsigned short i;
+
+	if (intno == 0x21 && regs.h.ah == 0x30) // Get DOS version, 5.0.
+	{
+		regs.h.al = 5;
+		regs.h.ah = 0;
+	}
+
+	if (intno != 0x67)
+	{
+		*outregs = regs;
+		return regs.x.ax;
+	}
+
+	switch (regs.h.ah)
+	{
+	case 0x40: // Get status.
+		regs.h.ah = 0;
+		break;
+	case 0x41: // Get page frame.
+		regs.x.bx = FAKE_EMS_FRAME_SEG;
+		regs.h.ah = 0;
+		break;
+	case 0x43: // Allocate pages.
+		if (regs.x.bx > fakeEmsNumFree)
+		{
+			regs.h.ah = 0x88;
+			break;
+		}
+		for (i = 0; i < FAKE_EMS_HANDLE_COUNT && fakeEmsHandles[i].pages; i++)
+		{
+		}
+		if (i == FAKE_EMS_HANDLE_COUNT)
+		{
+			regs.h.ah = 0x85;
+			break;
+		}
+		fakeEmsHandles[i].pages = (unsigned char *)malloc((regs.x.bx ? regs.x.bx : 1) * FAKE_EMS_PAGE_SIZE);
+		fakeEmsHandles[i].numAllocated = regs.x.bx;
+		fakeEmsNumFree -= regs.x.bx;
+		regs.x.dx = i + 1;
+		regs.h.ah = 0;
+		break;
+	case 0x44: // Map page.
+		handle = FakeEmsGetHandle(regs.x.dx);
+		if (!handle)
+		{
+			regs.h.ah = 0x83;
+			break;
+		}
+		if (regs.h.al != 0 || regs.x.bx >= handle->numAllocated)
+		{
+			regs.h.ah = 0x8A;
+			break;
+		}
+		FakeEmsUnmap();
+		memcpy(fakeMem + (FAKE_EMS_FRAME_SEG << 4),
+			   handle->pages + regs.x.bx * FAKE_EMS_PAGE_SIZE,
+			   FAKE_EMS_PAGE_SIZE);
+		fakeEmsMappedHandle = handle;
+		fakeEmsMappedPage = regs.x.bx;
+		regs.h.ah = 0;
+		break;
+	case 0x45: // Deallocate pages.
+		handle = FakeEmsGetHandle(regs.x.dx);
+		if (!handle)
+		{
+			regs.h.ah = 0x83;
+			break;
+		}
+		if (handle == fakeEmsMappedHandle)
+		{
+			FakeEmsUnmap();
+		}
+		free(handle->pages);
+		fakeEmsNumFree += handle->numAllocated;
+		memset(handle, 0, sizeof(FakeEmsHandle));
+		regs.h.ah = 0;
+		break;
+	default:
+		regs.h.ah = 0x84;
+		break;
+	}
+
+	*outregs = regs;
+	return regs.x.ax;
+}
+
+static int int86x(int intno, union REGS *inregs, union REGS *outregs, struct SREGS *segregs)
+{
+	union REGS regs = *inregs;
+	unsigned short seg;
+	unsigned short off;
+
+	if (intno != 0x2F || regs.h.ah != 0x13)
+	{
+		return int86(intno, inregs, outregs);
+	}
+
+	// Set disk interrupt handler, returning the previous ones.
+	seg = fakeDiskHandlerSeg;
+	off = fakeDiskHandlerOff;
+	fakeDiskHandlerSeg = segregs->ds;
+	fakeDiskHandlerOff = regs.x.dx;
+	segregs->ds = seg;
+	regs.x.dx = off;
+
+	seg = fakeDiskBootHandlerSeg;
+	off = fakeDiskBootHandlerOff;
+	fakeDiskBootHandlerSeg = segregs->es;
+	fakeDiskBootHandlerOff = regs.x.bx;
+	segregs->es = seg;
+	regs.x.bx = off;
+
+	*outregs = regs;
+	return regs.x.ax;
+}
+
+#ifdef FAKE_SNAPSHOTS
+
+// Snapshots of the fake address space, for setting up test scenarios
+// (half written blocks, old images, etc) without replaying flashes.
+// Snapshots are stored per 4K page. Pages that match the base snapshot,
+// or the initial fill when there is no base, share the same copy. Restore
+// only copies back pages that have changed. Only built when
+// FAKE_SNAPSHOTS is defined, see FAKETEST.C.
+//
+// EMS memory isn't part of the address space, so it isn't snapshotted.
+// Any mapped EMS page is unmapped first, which writes the frame back to
+// the page. Otherwise restoring would replace the frame contents, and the
+// next map would write them over the mapped page.
+
+typedef struct _FakePage
+{
+	long refCount;
+	unsigned char data[FAKE_PAGE_SIZE];
+} FakePage;
+
+typedef struct _FakeSnapshot
+{
+	FakePage *pages[FAKE_PAGE_COUNT];
+} FakeSnapshot;
+
+static FakePage *fakeFillPage;
+
+static FakePage *FakeAddPageRef(FakePage *page)
+{
+	page->refCount++;
+	return page;
+}
+
+static void FakeReleasePage(FakePage *page)
+{
+	if (page && --page->refCount == 0)
+	{
+		if (page == fakeFillPage)
+		{
+			fakeFillPage = NULL;
+		}
+
+		free(page);
+	}
+}
+
+static FakePage *FakeNewPage(const unsigned char *data)
+{
+	FakePage *page = (FakePage *)malloc(sizeof(FakePage));
+
+	page->refCount = 1;
+	memcpy(page->data, data, FAKE_PAGE_SIZE);
+
+	return page;
+}
+
+// Takes a snapshot of the address space. base may be NULL.
+static void FakeTakeSnapshot(FakeSnapshot *snapshotOut, const FakeSnapshot *base)
+{
+	const unsigned char *mem = (const unsigned char *)MK_FP(0, 0);
+	long i;
+
+	FakeEmsUnmap();
+
+	if (fakeFillPage == NULL)
+	{
+		fakeFillPage = (FakePage *)malloc(sizeof(FakePage));
+		fakeFillPage->refCount = 1;
+		memset(fakeFillPage->data, FAKE_MEM_FILL, FAKE_PAGE_SIZE);
+	}
+	else
+	{
+		FakeAddPageRef(fakeFillPage);
+	}
+
+	for (i = 0; i < FAKE_PAGE_COUNT; i++)
+	{
+		const unsigned char *pageMem = mem + i * FAKE_PAGE_SIZE;
+		FakePage *sharePage = base ? base->pages[i] : fakeFillPage;
+
+		if (memcmp(sharePage->data, pageMem, FAKE_PAGE_SIZE) == 0)
+		{
+			snapshotOut->pages[i] = FakeAddPageRef(sharePage);
+		}
+		else
+		{
+			snapshotOut->pages[i] = FakeNewPage(pageMem);
+		}
+	}
+
+	FakeReleasePage(fakeFillPage);
+}
+
+static void FakeRestoreSnapshot(const FakeSnapshot *snapshot)
+{
+	unsigned char *mem = (unsigned char *)MK_FP(0, 0);
+	long i;
+
+	FakeEmsUnmap();
+
+	for (i = 0; i < FAKE_PAGE_COUNT; i++)
+	{
+		unsigned char *pageMem = mem + i * FAKE_PAGE_SIZE;
+
+		if (memcmp(snapshot->pages[i]->data, pageMem, FAKE_PAGE_SIZE) != 0)
+		{
+			memcpy(pageMem, snapshot->pages[i]->data, FAKE_PAGE_SIZE);
+		}
+	}
+}
+
+static void FakeFreeSnapshot(FakeSnapshot *snapshot)
+{
+	long i;
+
+	for (i = 0; i < FAKE_PAGE_COUNT; i++)
+	{
+		FakeReleasePage(snapshot->pages[i]);
+	}
+
+	memset(snapshot, 0, sizeof(FakeSnapshot));
+}
+
+#endif